@@ -25,6 +25,36 @@ struct Poligon {
     struct Vector2d_c uv1, uv2, uv3, uv4;
 };
 
+struct ThingInstance {
+    struct Vector3d_c position;
+    // Radians in polygon space, facing (cos, sin) on x/z
+    float angle;
+    unsigned short flags;
+    unsigned short atlas;
+};
+
+struct ThingBatch {
+    unsigned short type;
+    // Sprite size and left/top offset in map units
+    struct Vector2d_c size;
+    struct Vector2d_c offset;
+    unsigned int count;
+    struct ThingInstance* instances;
+};
+
+struct MipLevel {
+    unsigned int size;
+    unsigned char* data;
+};
+
+struct WADLoadOptions {
+    // Gutter texels around every atlas rect, filled by wrapping the texture.
+    // Mip level n stays free of neighbour bleeding while 2^n <= padding.
+    unsigned int padding;
+    // Build the mip chain of the atlas page (BGRA, halved down to 1x1).
+    char mipmaps;
+};
+
 struct PoligonInfo {
     unsigned int atlasSize;
     struct Atlas* atlas;
@@ -32,11 +62,42 @@ struct PoligonInfo {
     unsigned int textureSize;
     unsigned int count;
     struct Poligon* polygons;
+    // Levels 1...n of `texture`, level 0 is `texture` itself.
+    unsigned int mipCount;
+    struct MipLevel* mips;
+    // Map objects grouped by thing type, one batch per sprite
+    unsigned int thingBatchCount;
+    struct ThingBatch* thingBatches;
+    // Atlas texels (gutters included) not spent on textures identical to an already packed one
+    unsigned int savedTexels;
 };
 
+// Square regions over the level in polygon space, region (column, row) starts at
+// origin + (column, row) * regionSize on x/z
+struct WADStreamGrid {
+    struct Vector2d_c origin;
+    float regionSize;
+    unsigned int columns;
+    unsigned int rows;
+};
+
+struct WADStream;
+
 struct PoligonInfo* loadPolygonsFromWadFile(const char* path, const char* levelName);
+struct PoligonInfo* loadPolygonsFromWadFileWithOptions(const char* path, const char* levelName, struct WADLoadOptions options);
 void deletePoligonInfo(struct PoligonInfo* info);
 
+// A stream keeps the level lumps, all patch data, texture definitions and the sprite
+// patches used so far resident; that part depends on the WAD, not on the map size.
+// Walls, things and atlas pages exist only for loaded regions: each region owns an
+// atlas page with just the textures it uses, and the stream owns the returned
+// PoligonInfo until the region is evicted or the stream is closed.
+struct WADStream* openWadStream(const char* path, const char* levelName, struct WADLoadOptions options, float regionSize);
+struct WADStreamGrid wadStreamGrid(const struct WADStream* stream);
+struct PoligonInfo* loadWadStreamRegion(struct WADStream* stream, unsigned int column, unsigned int row);
+void evictWadStreamRegion(struct WADStream* stream, unsigned int column, unsigned int row);
+void closeWadStream(struct WADStream* stream);
+
 #ifdef __cplusplus
 }
 #endif
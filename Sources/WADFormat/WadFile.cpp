@@ -1,11 +1,15 @@
 #include <fstream>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 
 #include <algorithm>
+#include <cmath>
 #include <sstream>
 #include <cstring>
 #include <stdexcept>
+#include <thread>
 
 #include "PublicHeader/Public.h"
 
@@ -63,17 +67,111 @@ struct WADSector {
     unsigned short tag;
 } __attribute__((packed));
 
+struct WADThing {
+    short x;
+    short y;
+    short angle;
+    unsigned short type;
+    unsigned short flags;
+} __attribute__((packed));
+
+struct WADSeg {
+    unsigned short start_vertex;
+    unsigned short end_vertex;
+    short angle;
+    unsigned short linedef;
+    short direction;
+    short offset;
+} __attribute__((packed));
+
+struct WADSubSector {
+    unsigned short seg_count;
+    unsigned short first_seg;
+} __attribute__((packed));
+
+struct WADNode {
+    short x;
+    short y;
+    short dx;
+    short dy;
+    short right_bbox[4];
+    short left_bbox[4];
+    unsigned short right_child;
+    unsigned short left_child;
+} __attribute__((packed));
+
 struct TextureAtlasInfo {
     int index;
     Vector2d_c size;
 };
 
+struct SpriteAtlasInfo {
+    int index;
+    Vector2d_c size;
+    Vector2d_c offset;
+};
+
 struct WADLevelData {
     vector<WADSector> sector;
     vector<WADVertex> vertex;
     vector<WADSideDef> side;
     vector<WADLineDef> line;
+    vector<WADThing> things;
+    vector<WADSeg> segs;
+    vector<WADSubSector> subSectors;
+    vector<WADNode> nodes;
     map<string, TextureAtlasInfo> uvs;
+    map<unsigned short, SpriteAtlasInfo> sprites;
+};
+
+struct WADThingSprite {
+    unsigned short type;
+    char sprite[5];
+    char frame;
+};
+
+// Doom editor numbers of drawable things, with the sprite and frame they spawn in
+static const WADThingSprite thingSprites[] = {
+    // Monsters
+    { 3004, "POSS", 'A' }, { 9, "SPOS", 'A' }, { 65, "CPOS", 'A' }, { 3001, "TROO", 'A' },
+    { 3002, "SARG", 'A' }, { 58, "SARG", 'A' }, { 3006, "SKUL", 'A' }, { 3005, "HEAD", 'A' },
+    { 3003, "BOSS", 'A' }, { 69, "BOS2", 'A' }, { 68, "BSPI", 'A' }, { 71, "PAIN", 'A' },
+    { 66, "SKEL", 'A' }, { 67, "FATT", 'A' }, { 64, "VILE", 'A' }, { 84, "SSWV", 'A' },
+    { 16, "CYBR", 'A' }, { 7, "SPID", 'A' }, { 72, "KEEN", 'A' },
+    // Weapons
+    { 2001, "SHOT", 'A' }, { 82, "SGN2", 'A' }, { 2002, "MGUN", 'A' }, { 2003, "LAUN", 'A' },
+    { 2004, "PLAS", 'A' }, { 2005, "CSAW", 'A' }, { 2006, "BFUG", 'A' },
+    // Ammo
+    { 2007, "CLIP", 'A' }, { 2048, "AMMO", 'A' }, { 2008, "SHEL", 'A' }, { 2049, "SBOX", 'A' },
+    { 2010, "ROCK", 'A' }, { 2046, "BROK", 'A' }, { 2047, "CELL", 'A' }, { 17, "CELP", 'A' },
+    { 8, "BPAK", 'A' },
+    // Health, armor and powerups
+    { 2011, "STIM", 'A' }, { 2012, "MEDI", 'A' }, { 2014, "BON1", 'A' }, { 2015, "BON2", 'A' },
+    { 2018, "ARM1", 'A' }, { 2019, "ARM2", 'A' }, { 2013, "SOUL", 'A' }, { 83, "MEGA", 'A' },
+    { 2022, "PINV", 'A' }, { 2023, "PSTR", 'A' }, { 2024, "PINS", 'A' }, { 2025, "SUIT", 'A' },
+    { 2026, "PMAP", 'A' }, { 2045, "PVIS", 'A' },
+    // Keys
+    { 5, "BKEY", 'A' }, { 6, "YKEY", 'A' }, { 13, "RKEY", 'A' },
+    { 40, "BSKU", 'A' }, { 39, "YSKU", 'A' }, { 38, "RSKU", 'A' },
+    // Decorations
+    { 2035, "BAR1", 'A' }, { 70, "FCAN", 'A' }, { 2028, "COLU", 'A' }, { 30, "COL1", 'A' },
+    { 31, "COL2", 'A' }, { 32, "COL3", 'A' }, { 33, "COL4", 'A' }, { 36, "COL5", 'A' },
+    { 37, "COL6", 'A' }, { 41, "CEYE", 'A' }, { 42, "FSKU", 'A' }, { 43, "TRE1", 'A' },
+    { 54, "TRE2", 'A' }, { 44, "TBLU", 'A' }, { 45, "TGRN", 'A' }, { 46, "TRED", 'A' },
+    { 55, "SMBT", 'A' }, { 56, "SMGT", 'A' }, { 57, "SMRT", 'A' }, { 47, "SMIT", 'A' },
+    { 48, "ELEC", 'A' }, { 34, "CAND", 'A' }, { 35, "CBRA", 'A' }, { 85, "TLMP", 'A' },
+    { 86, "TLP2", 'A' },
+    // Hanging bodies
+    { 49, "GOR1", 'A' }, { 63, "GOR1", 'A' }, { 50, "GOR2", 'A' }, { 59, "GOR2", 'A' },
+    { 51, "GOR3", 'A' }, { 61, "GOR3", 'A' }, { 52, "GOR4", 'A' }, { 60, "GOR4", 'A' },
+    { 53, "GOR5", 'A' }, { 62, "GOR5", 'A' }, { 73, "HDB1", 'A' }, { 74, "HDB2", 'A' },
+    { 75, "HDB3", 'A' }, { 76, "HDB4", 'A' }, { 77, "HDB5", 'A' }, { 78, "HDB6", 'A' },
+    // Gore and corpses
+    { 24, "POL5", 'A' }, { 25, "POL1", 'A' }, { 26, "POL6", 'A' }, { 27, "POL4", 'A' },
+    { 28, "POL2", 'A' }, { 29, "POL3", 'A' }, { 79, "POB1", 'A' }, { 80, "POB2", 'A' },
+    { 81, "BRS1", 'A' }, { 10, "PLAY", 'W' }, { 12, "PLAY", 'W' }, { 15, "PLAY", 'N' },
+    { 18, "POSS", 'L' }, { 19, "SPOS", 'L' }, { 20, "TROO", 'M' }, { 21, "SARG", 'N' },
+    { 22, "HEAD", 'L' }, { 23, "SKUL", 'K' },
 };
 
 struct WADPatches {
@@ -123,9 +221,87 @@ struct LumpNameComparator {
 
 #define Int16toFloat(x) (((float)x));
 
+struct AtlasOverflowError : runtime_error {
+    AtlasOverflowError(const string& name) : runtime_error("Atlas overflow: " + name) {}
+};
+
+typedef uint8_t Texel8 __attribute__((vector_size(4)));
+typedef uint16_t Texel16 __attribute__((vector_size(8)));
+
+class WADMipChainBuilder {
+public:
+    // Box filtered BGRA levels of a square power of two page, from size / 2 down to 1x1
+    vector<vector<uint8_t>> build(const vector<uint8_t>& base, uint32_t size) {
+        vector<vector<uint8_t>> levels;
+        uint32_t count = 0;
+        for (uint32_t levelSize = size / 2; levelSize > 0; levelSize /= 2) {
+            count++;
+        }
+        levels.reserve(count);
+
+        const vector<uint8_t>* source = &base;
+        uint32_t sourceSize = size;
+        while (sourceSize > 1) {
+            uint32_t levelSize = sourceSize / 2;
+            levels.push_back(vector<uint8_t>(levelSize * levelSize * 4));
+            downsample(*source, sourceSize, levels.back(), levelSize);
+            source = &levels.back();
+            sourceSize = levelSize;
+        }
+        return levels;
+    }
+
+private:
+    static const uint32_t minRowsPerThread = 32;
+
+    void downsample(const vector<uint8_t>& source, uint32_t sourceSize, vector<uint8_t>& output, uint32_t outputSize) {
+        uint32_t threadCount = max(1u, thread::hardware_concurrency());
+        threadCount = max(1u, min(threadCount, outputSize / minRowsPerThread));
+        if (threadCount == 1) {
+            downsampleRows(source, sourceSize, output, outputSize, 0, outputSize);
+            return;
+        }
+
+        uint32_t rowsPerThread = (outputSize + threadCount - 1) / threadCount;
+        vector<thread> workers;
+        for (uint32_t begin = 0; begin < outputSize; begin += rowsPerThread) {
+            uint32_t end = min(begin + rowsPerThread, outputSize);
+            workers.emplace_back([&, begin, end]() {
+                downsampleRows(source, sourceSize, output, outputSize, begin, end);
+            });
+        }
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    }
+
+    static void downsampleRows(const vector<uint8_t>& source, uint32_t sourceSize, vector<uint8_t>& output, uint32_t outputSize, uint32_t begin, uint32_t end) {
+        const Texel16 rounding = { 2, 2, 2, 2 };
+        for (uint32_t y = begin; y < end; y++) {
+            const uint8_t* top = &source[(size_t)(y * 2) * sourceSize * 4];
+            const uint8_t* bottom = top + (size_t)sourceSize * 4;
+            uint8_t* destination = &output[(size_t)y * outputSize * 4];
+            for (uint32_t x = 0; x < outputSize; x++) {
+                Texel16 sum = rounding + loadTexel(top) + loadTexel(top + 4) + loadTexel(bottom) + loadTexel(bottom + 4);
+                Texel8 result = __builtin_convertvector(sum >> 2, Texel8);
+                memcpy(destination, &result, sizeof(Texel8));
+                top += 8;
+                bottom += 8;
+                destination += 4;
+            }
+        }
+    }
+
+    static Texel16 loadTexel(const uint8_t* pixel) {
+        Texel8 value;
+        memcpy(&value, pixel, sizeof(Texel8));
+        return __builtin_convertvector(value, Texel16);
+    }
+};
+
 class WADLevelToPolygonConverter {
     Poligon ExportWallMesh(
-        WADLevelData level,
+        const WADLevelData &level,
         int floorHeight,
         int ceilingHeight,
         const char* textureName,
@@ -206,6 +382,119 @@ class WADLevelToPolygonConverter {
         return result;
     }
 
+    // Floor of the sector under (x, y) found through the BSP, 0 when the BSP data is broken
+    float floorAt(const WADLevelData &level, short x, short y) {
+        size_t subSector = 0;
+        if (!level.nodes.empty()) {
+            unsigned short child = (unsigned short)(level.nodes.size() - 1);
+            size_t steps = 0;
+            while (!(child & 0x8000)) {
+                if (child >= level.nodes.size() || steps++ > level.nodes.size()) {
+                    return 0;
+                }
+                const WADNode &node = level.nodes[child];
+                int64_t dx = x - node.x;
+                int64_t dy = y - node.y;
+                bool left = dy * node.dx >= dx * node.dy;
+                child = left ? node.left_child : node.right_child;
+            }
+            subSector = child & 0x7fff;
+        }
+        if (subSector >= level.subSectors.size() || level.subSectors[subSector].first_seg >= level.segs.size()) {
+            return 0;
+        }
+        const WADSeg &seg = level.segs[level.subSectors[subSector].first_seg];
+        if (seg.linedef >= level.line.size()) {
+            return 0;
+        }
+        const WADLineDef &line = level.line[seg.linedef];
+        unsigned short side = seg.direction ? line.left_sidedef : line.right_sidedef;
+        if (side >= level.side.size() || (size_t)level.side[side].sector >= level.sector.size()) {
+            return 0;
+        }
+        return (float)level.sector[level.side[side].sector].floor_height;
+    }
+
+    void exportThings(PoligonInfo* out, const WADLevelData &level, const vector<WADThing>& things, WADVertex center) {
+        bool hasBSP = !level.segs.empty() && !level.subSectors.empty();
+        map<unsigned short, vector<ThingInstance>> groups;
+        for (const auto& thing: things) {
+            auto sprite = level.sprites.find(thing.type);
+            if (sprite == level.sprites.end()) {
+                continue;
+            }
+            ThingInstance instance;
+            instance.position.x = (float)(center.x - thing.x);
+            instance.position.y = hasBSP ? floorAt(level, thing.x, thing.y) : 0;
+            instance.position.z = (float)(thing.y - center.y);
+            instance.angle = (float)(M_PI - thing.angle * M_PI / 180.0);
+            instance.flags = thing.flags;
+            instance.atlas = (unsigned short)sprite->second.index;
+            groups[thing.type].push_back(instance);
+        }
+
+        out->thingBatches = new ThingBatch[groups.size()]();
+        out->thingBatchCount = (unsigned int)groups.size();
+        size_t i = 0;
+        for (const auto& group: groups) {
+            const SpriteAtlasInfo &sprite = level.sprites.find(group.first)->second;
+            ThingBatch &batch = out->thingBatches[i++];
+            batch.type = group.first;
+            batch.size = sprite.size;
+            batch.offset = sprite.offset;
+            batch.count = (unsigned int)group.second.size();
+            batch.instances = new ThingInstance[group.second.size()];
+            memcpy(batch.instances, group.second.data(), group.second.size() * sizeof(ThingInstance));
+        }
+    }
+
+    PoligonInfo* makeInfo(const vector<Poligon>& result, const WADLevelData &level, const vector<WADThing>& things, WADVertex center) {
+        PoligonInfo* out = new PoligonInfo();
+        try {
+            out->polygons = new Poligon[result.size()];
+            out->count = (unsigned int)result.size();
+            memcpy(out->polygons, result.data(), result.size() * sizeof(Poligon));
+            exportThings(out, level, things, center);
+        } catch (...) {
+            deletePoligonInfo(out);
+            throw;
+        }
+        return out;
+    }
+
+    static bool hasTexture(const char* name) {
+        return name[0] != 0 && name[0] != '-';
+    }
+
+    // The one texture a side exports, by priority: middle, lower, upper
+    static const char* sideTexture(const WADSideDef &side) {
+        if (hasTexture(side.middle_texture)) {
+            return side.middle_texture;
+        } else if (hasTexture(side.lower_texture)) {
+            return side.lower_texture;
+        } else if (hasTexture(side.upper_texture)) {
+            return side.upper_texture;
+        }
+        return NULL;
+    }
+
+    // NULL for missing sides (0xFFFF on one-sided lines)
+    static const WADSideDef* sideAt(const WADLevelData &level, unsigned short index) {
+        return index < level.side.size() ? &level.side[index] : NULL;
+    }
+
+    void sideMesh(std::vector<Poligon>& result, const WADLevelData &level, const WADSideDef &side, const WADSector &sector, const WADSector &otherSector, const WADVertex *vertices, const WADLineDef &lineDef, char right, WADVertex center) {
+        const char* texture = sideTexture(side);
+        if (texture == side.middle_texture) {
+            result.push_back(ExportWallMesh(level, sector.floor_height, sector.ceiling_height, texture, side.offset_x, side.offset_y, vertices, lineDef, right, center));
+        } else if (texture == side.lower_texture) {
+            result.push_back(ExportWallMesh(level, sector.floor_height, otherSector.ceiling_height, texture, side.offset_x, side.offset_y, vertices, lineDef, right, center));
+        } else if (texture == side.upper_texture) {
+            result.push_back(ExportWallMesh(level, otherSector.floor_height, sector.ceiling_height, texture, side.offset_x, side.offset_y, vertices, lineDef, right, center));
+        }
+    }
+
+public:
     void findMinMax(const std::vector<WADVertex>& vertices, short& minX, short& maxX, short& minY, short& maxY) {
         // Инициализация минимальных и максимальных значений
         minX = std::numeric_limits<short>::max();
@@ -233,66 +522,83 @@ class WADLevelToPolygonConverter {
         }
     }
 
-public:
     void wallMesh(std::vector<Poligon>& result, const WADLevelData &level, const WADVertex *vertices, const WADLineDef &lineDef, WADVertex center) {
 
-        auto left = level.side[lineDef.left_sidedef];
-        auto right = level.side[lineDef.right_sidedef];
+        const WADSideDef *left = sideAt(level, lineDef.left_sidedef);
+        const WADSideDef *right = sideAt(level, lineDef.right_sidedef);
+        if (left == NULL && right == NULL) {
+            return;
+        }
 
-        const WADSector &rSideSector = level.sector[right.sector];
-        const WADSector &lSideSector = level.sector[left.sector];
+        const WADSector &rSideSector = level.sector[(right != NULL ? right : left)->sector];
+        const WADSector &lSideSector = level.sector[(left != NULL ? left : right)->sector];
 
-        if (left.middle_texture[0] != 0 && left.middle_texture[0] != '-') {
-            result.push_back(ExportWallMesh(level, lSideSector.floor_height, lSideSector.ceiling_height, left.middle_texture, left.offset_x, left.offset_y, vertices, lineDef, 1, center));
-        } else if (left.lower_texture[0] != 0 && left.lower_texture[0] != '-') {
-            result.push_back(ExportWallMesh(level, lSideSector.floor_height, rSideSector.ceiling_height, left.lower_texture, left.offset_x, left.offset_y, vertices, lineDef, 1, center));
-        } else if (left.upper_texture[0] != 0 && left.upper_texture[0] != '-') {
-            result.push_back(ExportWallMesh(level, rSideSector.floor_height, lSideSector.ceiling_height, left.upper_texture, left.offset_x, left.offset_y, vertices, lineDef, 1, center));
+        if (left != NULL) {
+            sideMesh(result, level, *left, lSideSector, rSideSector, vertices, lineDef, 1, center);
         }
-
-        if (right.middle_texture[0] != 0 && right.middle_texture[0] != '-') {
-            result.push_back(ExportWallMesh(level, rSideSector.floor_height, rSideSector.ceiling_height, right.middle_texture, right.offset_x, right.offset_y, vertices, lineDef, 0, center));
-        } else if (right.lower_texture[0] != 0 && right.lower_texture[0] != '-') {
-            result.push_back(ExportWallMesh(level, rSideSector.floor_height, lSideSector.ceiling_height, right.lower_texture, right.offset_x, right.offset_y, vertices, lineDef, 0, center));
-        } else if (right.upper_texture[0] != 0 && right.upper_texture[0] != '-') {
-            result.push_back(ExportWallMesh(level, lSideSector.floor_height, rSideSector.ceiling_height, right.upper_texture, right.offset_x, right.offset_y, vertices, lineDef, 0, center));
+        if (right != NULL) {
+            sideMesh(result, level, *right, rSideSector, lSideSector, vertices, lineDef, 0, center);
         }
     }
 
+    WADVertex levelCenter(const WADLevelData &level)
+    {
+        short minX, maxX, minY, maxY;
+        findMinMax(level.vertex, minX, maxX, minY, maxY);
+        WADVertex center = WADVertex();
+        center.x = (maxX + minX) / 2;
+        center.y = (maxY + minY) / 2;
+        return center;
+    }
+
     PoligonInfo* ExportLevel(const WADLevelData &level)
     {
         std::vector<Poligon> result;
         const WADLineDef *lineDefs = level.line.data();
         const size_t numLineDefs = level.line.size();
 
-        const WADSideDef *sideDefs = level.side.data();
-
         const WADVertex *vertices = level.vertex.data();
 
-        short minX, maxX, minY, maxY;
-        findMinMax(level.vertex, minX, maxX, minY, maxY);
-        WADVertex center = WADVertex();
-        center.x = (maxX + minX) / 2;
-        center.y = (maxY + minY) / 2;
-
-        float scale = max(maxX - minX, maxY - minY);
+        WADVertex center = levelCenter(level);
 
         for(size_t i = 0;i < numLineDefs; ++i)
         {
             wallMesh(result, level, vertices, lineDefs[i], center);
         }
 
-        PoligonInfo* out = new PoligonInfo();
-        out->polygons = new Poligon[result.size()];
-        out->count = (unsigned int)result.size();
-        memcpy(out->polygons, result.data(), result.size() * sizeof(Poligon));
-        return out;
+        return makeInfo(result, level, level.things, center);
+    }
+
+    PoligonInfo* ExportRegion(const WADLevelData &level, const vector<uint32_t>& lines, const vector<WADThing>& things, WADVertex center)
+    {
+        std::vector<Poligon> result;
+        for (auto line: lines) {
+            wallMesh(result, level, level.vertex.data(), level.line[line], center);
+        }
+        return makeInfo(result, level, things, center);
+    }
+
+    set<string> regionTextures(const WADLevelData &level, const vector<uint32_t>& lines)
+    {
+        set<string> result;
+        for (auto line: lines) {
+            const WADLineDef &lineDef = level.line[line];
+            for (auto sideIndex: { lineDef.left_sidedef, lineDef.right_sidedef }) {
+                const WADSideDef *side = sideAt(level, sideIndex);
+                const char* name = side != NULL ? sideTexture(*side) : NULL;
+                if (name != NULL) {
+                    result.insert(string(name, strnlen(name, 8)));
+                }
+            }
+        }
+        return result;
     }
 };
 
 class WADParser {
 public:
-    WADParser(const string& filename) {
+    // packTextures = false leaves the atlas empty until loadRegionAtlas
+    WADParser(const string& filename, WADLoadOptions options = WADLoadOptions(), bool packTextures = true) : options(options), packTextures(packTextures) {
         wad_file = new ifstream(filename, ios::binary);
         if (wad_file == NULL || !wad_file->is_open()) {
             throw runtime_error("Не удалось открыть файл");
@@ -320,11 +626,66 @@ public:
         levelData.vertex = loadData<WADVertex>(levelIt->second, "VERTEXES");
         levelData.side = loadData<WADSideDef>(levelIt->second, "SIDEDEFS");
         levelData.line = loadData<WADLineDef>(levelIt->second, "LINEDEFS");
+        levelData.things = loadOptionalData<WADThing>(levelIt->second, "THINGS");
+        levelData.segs = loadOptionalData<WADSeg>(levelIt->second, "SEGS");
+        levelData.subSectors = loadOptionalData<WADSubSector>(levelIt->second, "SSECTORS");
+        levelData.nodes = loadOptionalData<WADNode>(levelIt->second, "NODES");
+        if (packTextures) {
+            levelData.sprites = loadSprites(levelData.things);
+        }
         levelData.uvs = uvs;
 
         return levelData;
     }
 
+    // Packs `names` and the sprites of `things` into a fresh page, doubling it until they fit
+    void loadRegionAtlas(WADLevelData &level, const set<string>& names, const vector<WADThing>& things) {
+        uint32_t area = 0;
+        for (const auto& name: names) {
+            auto texture = textures.find(name);
+            if (texture != textures.end()) {
+                area += paddedTexels(texture->second);
+            }
+        }
+        set<const WADLump*> packedSprites;
+        for (const auto& thing: things) {
+            const WADLump* lump = thingSpriteLump(thing.type);
+            if (lump != NULL && packedSprites.insert(lump).second) {
+                const WADPatchData& data = patchData[spritePatch(*lump)];
+                area += paddedTexels(data.width, data.height);
+            }
+        }
+        uint16_t size = 64;
+        while (size < 4096 && (uint32_t)size * size < area) {
+            size *= 2;
+        }
+
+        for (;;) {
+            try {
+                resetAtlas(size);
+                for (const auto& name: names) {
+                    auto texture = textures.find(name);
+                    if (texture != textures.end()) {
+                        uvs[name] = loadTexture(name, texture->second);
+                    }
+                }
+                level.sprites = loadSprites(things);
+                level.uvs = uvs;
+                return;
+            } catch (AtlasOverflowError &e) {
+                if (size >= 4096) {
+                    throw;
+                }
+                size *= 2;
+            }
+        }
+    }
+
+    void releaseAtlas() {
+        resetAtlas(0);
+        globalTexture.shrink_to_fit();
+    }
+
     ~WADParser() {
         if (wad_file == NULL) {
             wad_file->close();
@@ -336,8 +697,11 @@ public:
     uint16_t globalTextureSize = 4096;
     map<string, TextureAtlasInfo> uvs;
     vector<Atlas> atlas;
+    uint32_t savedTexels = 0;
 
 private:
+    WADLoadOptions options;
+    bool packTextures;
     ifstream* wad_file;
     WADHeader header;
     vector<WADLump> lumps;
@@ -346,6 +710,17 @@ private:
     map<string, WADTexture12> textures;
     vector<WADPatchData> patchData;
     vector<uint8_t> palette;
+    map<string, WADLump> spriteLumps;
+    map<string, uint16_t> spritePatches;
+
+    struct PackedTexture {
+        TextureAtlasInfo info;
+        bool transparent;
+        vector<uint8_t> output;
+        vector<uint8_t> coverage;
+    };
+    unordered_map<string, TextureAtlasInfo> layoutAtlas;
+    unordered_map<uint64_t, vector<PackedTexture>> pixelAtlas;
 
     WADVertex globalTexturePosition;
     int globalTextureHeight;
@@ -355,11 +730,21 @@ private:
         wad_file->read(reinterpret_cast<char*>(&header), sizeof(WADHeader));
     }
 
-    void parse() {
+    void resetAtlas(uint16_t size) {
+        globalTextureSize = size;
         globalTextureHeight = 0;
         globalTexturePosition.x = 0;
         globalTexturePosition.y = 0;
-        globalTexture.resize(globalTextureSize * globalTextureSize * 4);
+        globalTexture.assign(size * size * 4, 0);
+        uvs.clear();
+        atlas.clear();
+        savedTexels = 0;
+        layoutAtlas.clear();
+        pixelAtlas.clear();
+    }
+
+    void parse() {
+        resetAtlas(packTextures ? globalTextureSize : 0);
         loadCategoryType();
         readHeader();
         readLumps();
@@ -367,6 +752,7 @@ private:
 
         loadLevel();
         loadPatch();
+        loadSpriteLumps();
     }
 
     void loadCategoryType() {
@@ -458,6 +844,93 @@ private:
         patchData.push_back(result);
     }
 
+    void loadSpriteLumps() {
+        bool inside = false;
+        for (const auto& lump: lumps) {
+            const string lumpName(lump.name, (strlen(lump.name) < 8 ?  strlen(lump.name) : 8));
+            if (lumpName == "S_START" || lumpName == "SS_START") {
+                inside = true;
+            } else if (lumpName == "S_END" || lumpName == "SS_END") {
+                inside = false;
+            } else if (inside && lump.size > 0) {
+                spriteLumps[lumpName] = lump;
+            }
+        }
+    }
+
+    // Front facing lump of the frame: rotation 0 (all angles) or 1
+    const WADLump* findSpriteLump(const WADThingSprite& sprite) {
+        string prefix = string(sprite.sprite) + sprite.frame;
+        for (auto it = spriteLumps.lower_bound(prefix); it != spriteLumps.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (it->first.size() > 5 && (it->first[5] == '0' || it->first[5] == '1')) {
+                return &it->second;
+            }
+        }
+        return NULL;
+    }
+
+    const WADLump* thingSpriteLump(unsigned short type) {
+        const WADThingSprite* sprite = find_if(begin(thingSprites), end(thingSprites), [&](const WADThingSprite& item) {
+            return item.type == type;
+        });
+        if (sprite == end(thingSprites)) {
+            return NULL;
+        }
+        return findSpriteLump(*sprite);
+    }
+
+    // Sprite lumps are read into patchData once, however many times they are packed
+    uint16_t spritePatch(const WADLump& lump) {
+        string name(lump.name, strnlen(lump.name, 8));
+        auto patch = spritePatches.find(name);
+        if (patch == spritePatches.end()) {
+            addNewPatch(lump);
+            patch = spritePatches.insert(make_pair(name, (uint16_t)(patchData.size() - 1))).first;
+        }
+        return patch->second;
+    }
+
+    map<unsigned short, SpriteAtlasInfo> loadSprites(const vector<WADThing>& things) {
+        map<unsigned short, SpriteAtlasInfo> result;
+        map<const WADLump*, SpriteAtlasInfo> packed;
+        for (const auto& thing: things) {
+            if (result.find(thing.type) != result.end()) {
+                continue;
+            }
+            const WADLump* lump = thingSpriteLump(thing.type);
+            if (lump == NULL) {
+                continue;
+            }
+            auto packedIt = packed.find(lump);
+            if (packedIt == packed.end()) {
+                packedIt = packed.insert(make_pair(lump, loadSprite(string(lump->name, strnlen(lump->name, 8)), *lump))).first;
+            }
+            result[thing.type] = packedIt->second;
+        }
+        return result;
+    }
+
+    SpriteAtlasInfo loadSprite(string name, WADLump lump) {
+        uint16_t patch = spritePatch(lump);
+        const WADPatchData& data = patchData[patch];
+
+        WADTexture12 texture = WADTexture12();
+        memcpy(texture.m_name, lump.name, 8);
+        texture.m_width = data.width;
+        texture.m_height = data.height;
+        texture.m_num_patches = 1;
+        texture.m_patches.push_back(WADPatches());
+        texture.m_patches[0].m_patch_id = patch;
+
+        TextureAtlasInfo info = loadTexture(name, texture, true);
+        SpriteAtlasInfo result;
+        result.index = info.index;
+        result.size = info.size;
+        result.offset.x = data.left_offset;
+        result.offset.y = data.top_offset;
+        return result;
+    }
+
     void loadAllTexture() {
         auto texture1 = find_if(lumps.begin(), lumps.end(), LumpNameComparator("TEXTURE1"));
         if (texture1 != lumps.end()) {
@@ -469,14 +942,66 @@ private:
             loadTextures(*texture2);
         }
 
+        if (!packTextures) {
+            return;
+        }
         for (auto texture: textures) {
-            loadTexture(texture.first, texture.second);
+            uvs[texture.first] = loadTexture(texture.first, texture.second);
+        }
+    }
+
+    static string textureLayoutKey(const WADTexture12& texture, bool transparent) {
+        string key(1, transparent ? 1 : 0);
+        key.append((const char*)&texture.m_masked, sizeof(texture.m_masked));
+        key.append((const char*)&texture.m_width, sizeof(texture.m_width));
+        key.append((const char*)&texture.m_height, sizeof(texture.m_height));
+        for (const auto& patch: texture.m_patches) {
+            key.append((const char*)&patch.m_origin_x, sizeof(patch.m_origin_x));
+            key.append((const char*)&patch.m_origin_y, sizeof(patch.m_origin_y));
+            key.append((const char*)&patch.m_patch_id, sizeof(patch.m_patch_id));
+        }
+        return key;
+    }
+
+    static uint64_t pixelHash(const vector<uint8_t>& output, const vector<uint8_t>& coverage, uint16_t width) {
+        uint64_t hash = 14695981039346656037ull ^ width;
+        for (auto value: output) {
+            hash = (hash ^ value) * 1099511628211ull;
+        }
+        for (auto value: coverage) {
+            hash = (hash ^ value) * 1099511628211ull;
         }
+        return hash;
     }
 
-    void loadTexture(string name, WADTexture12 texture) {
+    // Empty textures get no gutter, the wrap in loadTexture would divide by zero
+    int texturePadding(uint16_t width, uint16_t height) const {
+        return (width > 0 && height > 0) ? (int)options.padding : 0;
+    }
+
+    uint32_t paddedTexels(uint16_t width, uint16_t height) const {
+        int padding = texturePadding(width, height);
+        return (width + padding * 2) * (height + padding * 2);
+    }
+
+    uint32_t paddedTexels(const WADTexture12& texture) const {
+        return paddedTexels(texture.m_width, texture.m_height);
+    }
+
+    // Names with the same patch layout or the same composited pixels share one atlas rect.
+    // Only transparent (sprite) textures get alpha 0 where no patch covers a texel.
+    TextureAtlasInfo loadTexture(string name, WADTexture12 texture, bool transparent = false) {
+        string layoutKey = textureLayoutKey(texture, transparent);
+        auto layout = layoutAtlas.find(layoutKey);
+        if (layout != layoutAtlas.end()) {
+            savedTexels += paddedTexels(texture);
+            return layout->second;
+        }
+
         vector<uint8_t> output;
         output.resize(texture.m_width * texture.m_height * 3);
+        vector<uint8_t> coverage;
+        coverage.resize(texture.m_width * texture.m_height);
         std::size_t pixelCount = 0;
         for(int i = 0; i < texture.m_num_patches; ++i)
         {
@@ -534,6 +1059,7 @@ private:
                         for(int pixelCounter = 0;pixelCounter < count; ++pixelCounter)
                         {
                             output[((destColumnOffset + pixelCounter + position) * texture.m_width) + x] = *(source + pixelCounter);
+                            coverage[((destColumnOffset + pixelCounter + position) * texture.m_width) + x] = 1;
                         }
                         //destColumn += count;
                         destColumnOffset += count;
@@ -543,35 +1069,67 @@ private:
                 }
             }
         }
-        if (globalTexturePosition.x + texture.m_width >= globalTextureSize) {
+        output.resize(texture.m_width * texture.m_height);
+
+        // Coverage only reaches the page as alpha of transparent textures
+        if (!transparent) {
+            coverage.clear();
+        }
+        auto& candidates = pixelAtlas[pixelHash(output, coverage, texture.m_width)];
+        for (const auto& candidate: candidates) {
+            if (candidate.transparent == transparent && candidate.info.size.x == texture.m_width && candidate.output == output && candidate.coverage == coverage) {
+                savedTexels += paddedTexels(texture);
+                layoutAtlas[layoutKey] = candidate.info;
+                return candidate.info;
+            }
+        }
+
+        int padding = texturePadding(texture.m_width, texture.m_height);
+        int paddedWidth = texture.m_width + padding * 2;
+        int paddedHeight = texture.m_height + padding * 2;
+        if (paddedWidth > globalTextureSize) {
+            throw AtlasOverflowError(name);
+        }
+        if (globalTexturePosition.x + paddedWidth >= globalTextureSize) {
             globalTexturePosition.x = 0;
             globalTexturePosition.y = globalTextureHeight;
         }
-        for (int x = 0; x < texture.m_width; x++) {
-            for (int y = 0; y < texture.m_height; y++) {
-                auto position = (globalTexturePosition.x + x + (globalTexturePosition.y + y) * globalTextureSize) * 4;
-                auto pelettePos = (output[x + y * texture.m_width]) * 3;
+        if (globalTexturePosition.y + paddedHeight > globalTextureSize) {
+            throw AtlasOverflowError(name);
+        }
+        int originX = globalTexturePosition.x + padding;
+        int originY = globalTexturePosition.y + padding;
+        // Gutter repeats the opposite edge, the atlas shader tiles with fract()
+        for (int x = -padding; x < texture.m_width + padding; x++) {
+            int sourceX = (x % texture.m_width + texture.m_width) % texture.m_width;
+            for (int y = -padding; y < texture.m_height + padding; y++) {
+                int sourceY = (y % texture.m_height + texture.m_height) % texture.m_height;
+                auto position = (originX + x + (originY + y) * globalTextureSize) * 4;
+                auto pelettePos = (output[sourceX + sourceY * texture.m_width]) * 3;
                 globalTexture[position + 2] = palette[pelettePos];
                 globalTexture[position + 1] = palette[pelettePos + 1];
                 globalTexture[position] = palette[pelettePos + 2];
-                globalTexture[position + 3] = 255;
+                globalTexture[position + 3] = (!transparent || coverage[sourceX + sourceY * texture.m_width]) ? 255 : 0;
             }
         }
         int index = (int)atlas.size();
         auto item = Atlas();
-        item.position.x = ((float)globalTexturePosition.x) / ((float)globalTextureSize);
-        item.position.y = ((float)globalTexturePosition.y) / ((float)globalTextureSize);
+        item.position.x = ((float)originX) / ((float)globalTextureSize);
+        item.position.y = ((float)originY) / ((float)globalTextureSize);
         item.size.x = ((float)texture.m_width) / ((float)globalTextureSize);
         item.size.y = ((float)texture.m_height) / ((float)globalTextureSize);
         atlas.push_back(item);
-        uvs[name] = TextureAtlasInfo();
-        uvs[name].index = index;
-        uvs[name].size.x = texture.m_width;
-        uvs[name].size.y = texture.m_height;
-        globalTexturePosition.x += texture.m_width;
-        if (texture.m_height + globalTexturePosition.y > globalTextureHeight) {
-            globalTextureHeight = texture.m_height + globalTexturePosition.y;
+        TextureAtlasInfo info = TextureAtlasInfo();
+        info.index = index;
+        info.size.x = texture.m_width;
+        info.size.y = texture.m_height;
+        layoutAtlas[layoutKey] = info;
+        candidates.push_back(PackedTexture { info, transparent, std::move(output), std::move(coverage) });
+        globalTexturePosition.x += paddedWidth;
+        if (paddedHeight + globalTexturePosition.y > globalTextureHeight) {
+            globalTextureHeight = paddedHeight + globalTexturePosition.y;
         }
+        return info;
     }
 
     WADLump searchLump(const char *name) {
@@ -634,6 +1192,16 @@ private:
         return data;
     }
 
+    template<typename T>
+    // Missing or malformed (size not a multiple of the record) lumps read as empty
+    vector<T> loadOptionalData(const WADLevel& level, const char* targetName) {
+        auto it = find_if(level.data.begin(), level.data.end(), LumpNameComparator(targetName));
+        if (it == level.data.end() || it->size % sizeof(T) != 0) {
+            return vector<T>();
+        }
+        return loadData<T>(level, targetName);
+    }
+
     vector<WADLineDef> loadLineDefs(const WADLevel& level) {
         const char* targetName = "LINEDEFS";
         return loadData<WADLineDef>(level, targetName);
@@ -655,19 +1223,40 @@ private:
     }
 };
 
+static void exportAtlas(PoligonInfo* result, const WADParser& parser, WADLoadOptions options) {
+    result->texture = new unsigned char[4 * parser.globalTextureSize * parser.globalTextureSize];
+    result->textureSize = parser.globalTextureSize;
+    memcpy(result->texture, parser.globalTexture.data(), 4 * parser.globalTextureSize * parser.globalTextureSize);
+
+    result->savedTexels = parser.savedTexels;
+    result->atlasSize = (int)parser.atlas.size();
+    result->atlas = new Atlas[parser.atlas.size()];
+    memcpy(result->atlas, parser.atlas.data(), sizeof(Atlas) * parser.atlas.size());
+
+    if (options.mipmaps) {
+        auto levels = WADMipChainBuilder().build(parser.globalTexture, parser.globalTextureSize);
+        result->mips = new MipLevel[levels.size()];
+        uint32_t levelSize = parser.globalTextureSize;
+        for (size_t i = 0; i < levels.size(); i++) {
+            levelSize /= 2;
+            result->mips[i].size = levelSize;
+            result->mips[i].data = new unsigned char[levels[i].size()];
+            memcpy(result->mips[i].data, levels[i].data(), levels[i].size());
+            result->mipCount = (unsigned int)(i + 1);
+        }
+    }
+}
+
 PoligonInfo* loadPolygonsFromWadFile(const char* path, const char* levelName) {
+    return loadPolygonsFromWadFileWithOptions(path, levelName, WADLoadOptions());
+}
+
+PoligonInfo* loadPolygonsFromWadFileWithOptions(const char* path, const char* levelName, WADLoadOptions options) {
     try {
-        WADParser parser = WADParser(path);
+        WADParser parser = WADParser(path, options);
         WADLevelData data = parser.loadLevel(levelName);
         PoligonInfo* result = WADLevelToPolygonConverter().ExportLevel(data);
-        result->texture = new unsigned char[4 * parser.globalTextureSize * parser.globalTextureSize];
-        result->textureSize = parser.globalTextureSize;
-        memcpy(result->texture, parser.globalTexture.data(), 4 * parser.globalTextureSize * parser.globalTextureSize);
-
-        result->atlasSize = (int)parser.atlas.size();
-        result->atlas = new Atlas[parser.atlas.size()];
-        memcpy(result->atlas, parser.atlas.data(), sizeof(Atlas) * parser.atlas.size());
-
+        exportAtlas(result, parser, options);
         return result;
     }
     catch(std::exception &e) {
@@ -680,6 +1269,138 @@ void deletePoligonInfo(struct PoligonInfo* info) {
         delete info->atlas;
         delete info->texture;
         delete info->polygons;
+        for (unsigned int i = 0; i < info->mipCount; i++) {
+            delete[] info->mips[i].data;
+        }
+        delete[] info->mips;
+        for (unsigned int i = 0; i < info->thingBatchCount; i++) {
+            delete[] info->thingBatches[i].instances;
+        }
+        delete[] info->thingBatches;
         delete info;
     }
 }
+
+struct WADStream {
+    static constexpr float maxRegionsPerAxis = 256;
+
+    WADParser parser;
+    WADLoadOptions options;
+    WADLevelData level;
+    WADVertex center;
+    WADStreamGrid grid;
+    vector<vector<uint32_t>> lines;
+    vector<vector<WADThing>> things;
+    map<uint32_t, PoligonInfo*> regions;
+
+    WADStream(const char* path, const char* levelName, WADLoadOptions options, float regionSize) :
+        parser(path, options, false),
+        options(options),
+        level(parser.loadLevel(levelName))
+    {
+        WADLevelToPolygonConverter converter;
+        short minX, maxX, minY, maxY;
+        converter.findMinMax(level.vertex, minX, maxX, minY, maxY);
+        center = converter.levelCenter(level);
+
+        // Polygon space mirrors x: x = center.x - mapX, z = mapY - center.y
+        grid.origin.x = (float)(center.x - maxX);
+        grid.origin.y = (float)(minY - center.y);
+        // Tiny regions would make the grid (and its per-region lists) explode
+        float extent = (float)max(maxX - minX, maxY - minY);
+        regionSize = max(regionSize, max(1.0f, extent / maxRegionsPerAxis));
+        grid.regionSize = regionSize;
+        grid.columns = (unsigned int)((maxX - minX) / regionSize) + 1;
+        grid.rows = (unsigned int)((maxY - minY) / regionSize) + 1;
+
+        lines.resize(grid.columns * grid.rows);
+        things.resize(grid.columns * grid.rows);
+        for (size_t i = 0; i < level.line.size(); i++) {
+            const WADVertex &start = level.vertex[level.line[i].start_vertex];
+            const WADVertex &end = level.vertex[level.line[i].end_vertex];
+            lines[regionIndex((start.x + end.x) / 2, (start.y + end.y) / 2, maxX, minY)].push_back((uint32_t)i);
+        }
+        for (const auto& thing: level.things) {
+            things[regionIndex(thing.x, thing.y, maxX, minY)].push_back(thing);
+        }
+    }
+
+    ~WADStream() {
+        for (auto region: regions) {
+            deletePoligonInfo(region.second);
+        }
+    }
+
+    uint32_t regionIndex(int x, int y, short maxX, short minY) const {
+        int column = (int)((maxX - x) / grid.regionSize);
+        int row = (int)((y - minY) / grid.regionSize);
+        column = max(0, min(column, (int)grid.columns - 1));
+        row = max(0, min(row, (int)grid.rows - 1));
+        return (uint32_t)(row * grid.columns + column);
+    }
+
+    PoligonInfo* loadRegion(uint32_t index) {
+        auto region = regions.find(index);
+        if (region != regions.end()) {
+            return region->second;
+        }
+        WADLevelToPolygonConverter converter;
+        PoligonInfo* result = NULL;
+        try {
+            parser.loadRegionAtlas(level, converter.regionTextures(level, lines[index]), things[index]);
+            result = converter.ExportRegion(level, lines[index], things[index], center);
+            exportAtlas(result, parser, options);
+            regions[index] = result;
+        } catch (...) {
+            // A failed load must not keep the page (up to 4096^2) or a half built region
+            parser.releaseAtlas();
+            deletePoligonInfo(result);
+            throw;
+        }
+        parser.releaseAtlas();
+        return result;
+    }
+};
+
+WADStream* openWadStream(const char* path, const char* levelName, WADLoadOptions options, float regionSize) {
+    if (!(regionSize > 0)) {
+        return NULL;
+    }
+    try {
+        return new WADStream(path, levelName, options, regionSize);
+    }
+    catch(std::exception &e) {
+        return NULL;
+    }
+}
+
+WADStreamGrid wadStreamGrid(const WADStream* stream) {
+    return stream->grid;
+}
+
+PoligonInfo* loadWadStreamRegion(WADStream* stream, unsigned int column, unsigned int row) {
+    if (column >= stream->grid.columns || row >= stream->grid.rows) {
+        return NULL;
+    }
+    try {
+        return stream->loadRegion(row * stream->grid.columns + column);
+    }
+    catch(std::exception &e) {
+        return NULL;
+    }
+}
+
+void evictWadStreamRegion(WADStream* stream, unsigned int column, unsigned int row) {
+    if (column >= stream->grid.columns || row >= stream->grid.rows) {
+        return;
+    }
+    auto region = stream->regions.find(row * stream->grid.columns + column);
+    if (region != stream->regions.end()) {
+        deletePoligonInfo(region->second);
+        stream->regions.erase(region);
+    }
+}
+
+void closeWadStream(WADStream* stream) {
+    delete stream;
+}